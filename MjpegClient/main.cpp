@@ -9,6 +9,7 @@ int main(int argc, char *argv[]) {
     const char name[] = "mjpg"; //extension
 
     MjpgClient client(ip, port, name); //Get cap line
+    client.waitReady(2000); //Wait up to 2 seconds for the background connect
 
     int counts = 0; //Just a fps pull counter
     client.setDiscDim(640, 480); //Set disconnected image size
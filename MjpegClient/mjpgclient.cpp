@@ -23,17 +23,71 @@
 */
 #include "mjpgclient.h"
 
-int MjpgClient::getLine(char* ip) {
+const cv::Mat& MjpgClient::defaultNoConnection() {
+    //Decoded once and shared by every client (local statics are thread safe in c++11)
+    static const cv::Mat no_connection = cv::imread("noconnection.jpg");
+    return no_connection;
+}
+
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && (CV_VERSION_MINOR > 5 || (CV_VERSION_MINOR == 5 && CV_VERSION_REVISION >= 2)))
+#define MJPGCLIENT_OPEN_TIMEOUT_PARAMS
+#elif CV_VERSION_MAJOR == 4 || (CV_VERSION_MAJOR == 3 && CV_VERSION_MINOR >= 4)
+#define MJPGCLIENT_OPEN_TIMEOUT_ENV
+static bool setFfmpegTimeout(int timeout) {
+    //3.4 up to 4.5.1 only take ffmpeg options from the environment (timeout is in micros), don't override the user's
+    if(getenv("OPENCV_FFMPEG_CAPTURE_OPTIONS") != NULL) return false;
+    std::stringstream st;
+    st << "timeout;" << (long long) timeout * 1000;
+#ifdef _WIN32
+    return _putenv_s("OPENCV_FFMPEG_CAPTURE_OPTIONS", st.str().c_str()) == 0;
+#else
+    return setenv("OPENCV_FFMPEG_CAPTURE_OPTIONS", st.str().c_str(), 0) == 0;
+#endif
+}
+#else
+#define MJPGCLIENT_OPEN_PROBE
+static bool probeLine(const std::string& host, const std::string& port, int timeout) {
+    //Nothing bounds the open before 3.4, so at least make sure the server is reachable within the timeout
+    boost::asio::io_service io_service;
+    tcp::resolver resolver(io_service);
+    tcp::socket socket(io_service);
+    boost::asio::deadline_timer timer(io_service, boost::posix_time::milliseconds(timeout));
+    bool reached = false;
+    timer.async_wait([&](const boost::system::error_code& err) {
+        if(err == boost::asio::error::operation_aborted) return;
+        boost::system::error_code ignored;
+        resolver.cancel();
+        socket.close(ignored);
+    });
+    resolver.async_resolve(tcp::resolver::query(host, port),
+        [&](const boost::system::error_code& err, tcp::resolver::iterator endpoints) {
+            if(err) {
+                timer.cancel();
+                return;
+            }
+            boost::asio::async_connect(socket, endpoints,
+                [&](const boost::system::error_code& err, tcp::resolver::iterator) {
+                    reached = !err;
+                    timer.cancel();
+                });
+        });
+    io_service.run();
+    return reached;
+}
+#endif
+
+int MjpgClient::getLine(const std::string& ip, int timeout, cv::VideoCapture& mjpgcap) {
     try {
-        cv::VideoCapture mjpgcap;
+#ifdef MJPGCLIENT_OPEN_TIMEOUT_PARAMS
+        //Reads keep the backend's default timeout so slow streams don't drop
+        std::vector<int> params = {cv::CAP_PROP_OPEN_TIMEOUT_MSEC, timeout};
+        mjpgcap.open(ip, cv::CAP_ANY, params);
+#else
         mjpgcap.open(ip);
-        int count_max = 0;
-        while(!mjpgcap.isOpened()) {
-            if(count_max++ > this->max_retry) {
-                throw std::invalid_argument("stream invalid");
-            }
+#endif
+        if(!mjpgcap.isOpened()) {
+            throw std::invalid_argument("stream invalid");
         }
-        this->mjpgcap = mjpgcap;
         return 0;
     } catch(std::exception& err) {
         std::cerr << "Failed to open mjpg stream..." << std::endl;
@@ -41,6 +95,84 @@ int MjpgClient::getLine(char* ip) {
     }
 }
 
+void MjpgClient::applyCapProps(Line& line) {
+    std::map<int, double> props;
+    {
+        boost::lock_guard<boost::mutex> guard(this->ctrl_lock);
+        props.swap(this->cap_props);
+    }
+    if(props.empty()) return;
+    boost::lock_guard<boost::mutex> guard(line.cap_lock);
+    for(std::map<int, double>::iterator prop = props.begin(); prop != props.end(); ++prop) {
+        try {
+            if(!line.mjpgcap.set(prop->first, prop->second))
+                std::cerr << "Capture didn't take property " << prop->first << std::endl;
+        } catch(std::exception& err) {
+            std::cerr << "Error setting capture property: " << err.what() << std::endl;
+        }
+    }
+}
+
+void MjpgClient::connect() {
+    boost::shared_ptr<Line> line = this->line;
+    boost::unique_lock<boost::mutex> lock(line->conn_lock);
+    if(line->connecting) return;
+    line->connecting = true;
+    line->connected = false;
+    lock.unlock();
+
+    try {
+        boost::lock_guard<boost::mutex> guard(line->cap_lock);
+        line->mjpgcap.release();
+    } catch(std::exception& safetyrelease) {}
+
+#ifdef MJPGCLIENT_OPEN_TIMEOUT_ENV
+    //Set before the first connect thread exists so nothing reads the environment meanwhile
+    static bool ffmpeg_timeout = setFfmpegTimeout(this->connect_timeout.load());
+    (void) ffmpeg_timeout;
+#endif
+
+    //Detached so a hung open never blocks init or the destructor, the thread keeps its line alive
+    std::string addr = this->addr;
+    int timeout = this->connect_timeout.load();
+    std::string host(this->ip);
+    this->replace(host, "http://", "");
+    std::string port = std::to_string(this->port);
+    boost::thread([line, addr, timeout, host, port]() {
+        cv::VideoCapture mjpgcap;
+#ifdef MJPGCLIENT_OPEN_PROBE
+        bool good = probeLine(host, port, timeout) && getLine(addr, timeout, mjpgcap) == 0;
+#else
+        (void) host;
+        (void) port;
+        bool good = getLine(addr, timeout, mjpgcap) == 0;
+#endif
+        if(!good)
+            std::cerr << "Bad connection..." << std::endl;
+        {
+            boost::lock_guard<boost::mutex> guard(line->cap_lock);
+            line->mjpgcap = mjpgcap;
+        }
+        boost::lock_guard<boost::mutex> guard(line->conn_lock);
+        line->connected = good;
+        line->connecting = false;
+        line->conn_cond.notify_all();
+    }).detach();
+}
+
+bool MjpgClient::waitReady(int timeout) {
+    boost::shared_ptr<Line> line = this->line;
+    boost::unique_lock<boost::mutex> lock(line->conn_lock);
+    line->conn_cond.wait_for(lock, boost::chrono::milliseconds(timeout), [line]() {
+        return line->connected || !line->connecting;
+    });
+    return line->connected;
+}
+
+void MjpgClient::setConnectTimeout(int timeout) {
+    this->connect_timeout = timeout;
+}
+
 template <class T>
 int MjpgClient::numDigits(T number) {
     int digits = 0;
@@ -206,7 +338,10 @@ int MjpgClient::getServerFPS() {
 }
 
 int* MjpgClient::getServerResolution() {
-    int dims[2] = {0, 0};
+    //One per thread so concurrent callers don't overwrite each other's result
+    static thread_local int dims[2];
+    dims[0] = 0;
+    dims[1] = 0;
     try {
         std::string response;
         this->getReq("resolution", &response);
@@ -250,7 +385,9 @@ bool MjpgClient::setServerResolution(int width, int height) {
 
 bool MjpgClient::setFPS(int fps) {
     try {
-        return this->mjpgcap.set(CV_CAP_PROP_FPS, fps);
+        boost::lock_guard<boost::mutex> guard(this->ctrl_lock);
+        this->cap_props[CV_CAP_PROP_FPS] = fps;
+        return true;
     } catch(std::exception& e) {
         std::cerr << "Couldn't set local fps: " << e.what() << std::endl;
         return false;
@@ -292,21 +429,19 @@ bool MjpgClient::setServerConnections(int connections) {
 }
 
 int* MjpgClient::getResolution() {
-    int dims[2] = {0, 0};
-    try {
-        dims[0] = this->mjpgcap.get(CV_CAP_PROP_FRAME_WIDTH);
-        dims[1] = this->mjpgcap.get(CV_CAP_PROP_FRAME_HEIGHT);
-    } catch(std::exception& err) {
-        std::cerr << "Problem getting resolution" << std::endl;
-    }
+    //One per thread so concurrent callers don't overwrite each other's result
+    static thread_local int dims[2];
+    dims[0] = this->cap_width;
+    dims[1] = this->cap_height;
+    return dims;
 }
 
 bool MjpgClient::setResolution(int width, int height) {
     try {
-        bool good = true;
-        if(!this->mjpgcap.set(cv::CAP_PROP_FRAME_WIDTH, width)) good = false;
-        if(!this->mjpgcap.set(cv::CAP_PROP_FRAME_HEIGHT, width)) good = false;
-        return good;
+        boost::lock_guard<boost::mutex> guard(this->ctrl_lock);
+        this->cap_props[cv::CAP_PROP_FRAME_WIDTH] = width;
+        this->cap_props[cv::CAP_PROP_FRAME_HEIGHT] = height;
+        return true;
     } catch(std::exception& err) {
         std::cout << "Error setting new resolution" << std::endl;
         return false;
@@ -327,7 +462,11 @@ bool MjpgClient::setServerQuality(int quality) {
 
 bool MjpgClient::setDiscDim(int width, int height) {
     try {
-        cv::resize(this->no_connection, this->no_connection, cv::Size(width, height), 0, 0, cv::INTER_LINEAR);
+        //Resize into a new mat so the shared no connection image isn't touched
+        boost::lock_guard<boost::mutex> guard(this->ctrl_lock);
+        cv::Mat resized;
+        cv::resize(*boost::atomic_load(&this->no_connection), resized, cv::Size(width, height), 0, 0, cv::INTER_LINEAR);
+        boost::atomic_store(&this->no_connection, boost::make_shared<const cv::Mat>(resized));
         return true;
     } catch(std::exception& err) {
         std::cerr << "Failed setting new no connection image" << std::endl;
@@ -337,7 +476,9 @@ bool MjpgClient::setDiscDim(int width, int height) {
 
 bool MjpgClient::setDiscPath(const char* path) {
     try {
-        this->no_connection = cv::imread(path);
+        boost::unique_lock<boost::mutex> lock(this->ctrl_lock);
+        boost::atomic_store(&this->no_connection, boost::make_shared<const cv::Mat>(cv::imread(path)));
+        lock.unlock();
         if(this->disc_width > 0 && this->disc_height > 0) this->setDiscDim(this->disc_width, this->disc_height);
         return true;
     } catch(std::exception& err) {
@@ -346,80 +487,161 @@ bool MjpgClient::setDiscPath(const char* path) {
 }
 
 void MjpgClient::init(const char* ip, int port, const char* name, char* buf) {
+    //Start on a new line, a connect still running on the old one finishes on its own
+    this->line = boost::make_shared<Line>();
+    this->stopPreview();
     sprintf(buf, "%s:%d/%s", ip, port, name);
-    if(getLine(buf) != 0)
-        std::cerr << "Bad connection..." << std::endl;
+    this->port = port;
+    this->ip = ip;
+    this->name = name;
+    this->addr = buf;
     this->start = boost::chrono::high_resolution_clock::now();
+    this->connect();
 }
 
 MjpgClient::~MjpgClient() {
+    this->stopPreview();
     try {
-        this->mjpgcap.release();
+        if(this->line) {
+            boost::lock_guard<boost::mutex> guard(this->line->cap_lock);
+            this->line->mjpgcap.release();
+        }
     } catch(std::exception& safetyrelease) {}
 }
 
 MjpgClient::MjpgClient(const char* ip, int port, const char* name) {
-    int addr_length = (sizeof(ip) + sizeof(name)) + this->numDigits(port);
-    char *addr = new char[addr_length] ;
+    int addr_length = strlen(ip) + strlen(name) + this->numDigits(port) + 4;
+    char *addr = new char[addr_length];
     this->max_retry = 20;
     try {
-        this->no_connection = cv::imread("noconnection.jpg");
-        this->cur_frame = this->no_connection;
+        this->no_connection = boost::make_shared<const cv::Mat>(defaultNoConnection());
+        Frame first = {*this->no_connection, 0};
+        this->snapshot = boost::make_shared<const Frame>(first);
         this->init(ip, port, name, addr);
     } catch(std::exception& badconnection) {
         std::cerr << "Initialization failed" << std::endl;
         sleep(100);
     }
-    this->port = port;
-    this->ip = ip;
-    this->name = name;
-    this->addr = addr;
     std::cout << "Mjpeg client init at addr: " << addr << std::endl;
+    delete[] addr;
 }
 
 cv::Mat MjpgClient::getFrameMat() {
+    boost::unique_lock<boost::mutex> pull(this->pull_lock, boost::try_to_lock);
+    if(!pull.owns_lock()) {
+        //Another thread is already pulling so hand back the last published frame
+        return boost::atomic_load(&this->snapshot)->mat;
+    }
+    return this->pullFrame(pull)->mat;
+}
+
+cv::Mat MjpgClient::getNextFrameMat(unsigned long& seq) {
+    boost::shared_ptr<const Frame> frame = boost::atomic_load(&this->snapshot);
+    while(frame->seq <= seq) {
+        unsigned long pulls;
+        {
+            boost::lock_guard<boost::mutex> guard(this->frame_lock);
+            pulls = this->pull_count;
+        }
+        boost::unique_lock<boost::mutex> pull(this->pull_lock, boost::try_to_lock);
+        if(pull.owns_lock()) {
+            frame = this->pullFrame(pull);
+            break;
+        }
+
+        //The puller may have published what we already have, so also wake up when it lets go and pull ourselves
+        boost::unique_lock<boost::mutex> lock(this->frame_lock);
+        this->frame_cond.wait(lock, [this, seq, pulls]() {
+            return boost::atomic_load(&this->snapshot)->seq > seq || this->pull_count != pulls;
+        });
+        frame = boost::atomic_load(&this->snapshot);
+    }
+    seq = frame->seq;
+    return frame->mat;
+}
+
+unsigned long MjpgClient::getFrameSeq() {
+    return boost::atomic_load(&this->snapshot)->seq;
+}
+
+boost::shared_ptr<const MjpgClient::Frame> MjpgClient::pullFrame(boost::unique_lock<boost::mutex>& pull) {
+    boost::shared_ptr<Line> line = this->line;
+    cv::Mat cur_frame;
+    bool bad_frame = false;
     try {
-        this->mjpgcap.read(this->cur_frame);
+        bool ready;
+        {
+            boost::lock_guard<boost::mutex> guard(line->conn_lock);
+            ready = line->connected;
+        }
 
-        if(this->cur_frame.empty()) {
-            this->cur_frame = this->last_frame;
+        //Read into a new mat so a frame never gets copied over the no connection image
+        if(ready) {
+            this->applyCapProps(*line);
+            boost::lock_guard<boost::mutex> guard(line->cap_lock);
+            line->mjpgcap.read(cur_frame);
+        }
+        if(!cur_frame.empty()) {
+            this->cap_width = cur_frame.cols;
+            this->cap_height = cur_frame.rows;
+        }
 
-        if(this->cur_frame.empty())
-            this->cur_frame = this->no_connection;
+        if(cur_frame.empty()) {
+            cur_frame = this->last_frame;
+            if(cur_frame.empty())
+                cur_frame = *boost::atomic_load(&this->no_connection);
             if(this->bad_count++ > this->max_retry) {
                 throw std::invalid_argument("Max empty frame limit... attempting to connect again");
             }
-            sleep(50);
+            bad_frame = true;
         }
     } catch(std::exception& badframe) {
         std::cerr << badframe.what() << std::endl;
-        this->cur_frame = this->no_connection;
+        cur_frame = *boost::atomic_load(&this->no_connection);
         if(this->bad_count++ > this->max_retry) {
                 bad_count = 0;
                 try {
-                    this->mjpgcap.release();
-                    this->init(this->ip.c_str(), this->port, this->name.c_str(), const_cast<char *>(reinterpret_cast<const char *>(this->addr.c_str())));
+                    this->connect();
                 } catch(std::exception& reinit) {
                     std::cerr << "Failed reinitializing stream..." << std::endl;
                 }
         }
     }
     boost::chrono::high_resolution_clock::time_point now = boost::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now - this->start).count();
+    auto duration = boost::chrono::duration_cast<boost::chrono::milliseconds>(now - this->start).count();
     this->frames++;
     if(duration > 100 && frames > 30) {
-        this->real_fps = (float) ((frames * 1000) / duration);
+        this->real_fps = (int) ((frames * 1000) / duration);
         this->start = now;
         this->frames = 0;
     }
-    return this->cur_frame;
+    Frame published = {cur_frame, ++this->frame_seq};
+    boost::shared_ptr<const Frame> frame = boost::make_shared<const Frame>(published);
+    boost::atomic_store(&this->snapshot, frame);
+    pull.unlock();
+    {
+        //Counted after letting go so a reader that lost the try lock to us always wakes up
+        boost::lock_guard<boost::mutex> guard(this->frame_lock);
+        this->pull_count++;
+    }
+    this->frame_cond.notify_all();
+
+    if(bad_frame) {
+        //Wait out the bad frame (without blocking other readers) but wake up early if a pending connect finishes
+        boost::unique_lock<boost::mutex> lock(line->conn_lock);
+        bool was_connecting = line->connecting;
+        line->conn_cond.wait_for(lock, boost::chrono::milliseconds(50), [line, was_connecting]() {
+            return was_connecting && !line->connecting;
+        });
+    }
+    return frame;
 }
 
 std::string MjpgClient::getFrame() {
     try {
-        this->getFrameMat();
+        cv::Mat cur_frame = this->getFrameMat();
         std::vector<uchar> buff;
-        cv::imencode(".jpg", this->cur_frame, buff);
+        cv::imencode(".jpg", cur_frame, buff);
         std::string content(buff.begin(), buff.end());
         return content;
     } catch(std::exception& err) {
@@ -427,3 +649,371 @@ std::string MjpgClient::getFrame() {
         return std::string();
     }
 }
+
+#if CV_VERSION_MAJOR > 3 || (CV_VERSION_MAJOR == 3 && CV_VERSION_MINOR >= 2)
+#define MJPGCLIENT_REDUCED_DECODE
+#endif
+
+static unsigned int jpegByte(const std::string& jpg, size_t pos) {
+    return (unsigned char) jpg[pos];
+}
+
+static size_t jpegEnd(const std::string& buf, size_t soi) {
+    //Walk the markers from SOI to EOI, returns npos if more data is needed and 0 if it isn't a jpeg
+    size_t pos = soi + 2;
+    while(true) {
+        if(pos + 2 > buf.size()) return std::string::npos;
+        if(jpegByte(buf, pos) != 0xFF) return 0;
+        unsigned int marker = jpegByte(buf, pos + 1);
+        if(marker == 0xFF) {
+            pos++;
+            continue;
+        }
+        if(marker == 0xD9) return pos + 2;
+        if(marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+            pos += 2;
+            continue;
+        }
+        if(pos + 4 > buf.size()) return std::string::npos;
+        pos += 2 + (jpegByte(buf, pos + 2) << 8 | jpegByte(buf, pos + 3));
+        if(marker != 0xDA) continue;
+
+        //Entropy coded data only ends at a marker that isn't a stuffed 0xFF00 or a restart
+        while(true) {
+            if(pos + 2 > buf.size()) return std::string::npos;
+            if(jpegByte(buf, pos) == 0xFF) {
+                unsigned int next = jpegByte(buf, pos + 1);
+                if(next == 0x00 || (next >= 0xD0 && next <= 0xD7)) {
+                    pos += 2;
+                    continue;
+                }
+                if(next != 0xFF) break;
+            }
+            pos++;
+        }
+    }
+}
+
+static void jpegHeader(const std::string& jpg, int& width, int& height, std::string& exif_thumb) {
+    //Frame size from the SOF segment and the EXIF (APP1) thumbnail if there is one
+    size_t pos = 2;
+    while(pos + 4 <= jpg.size() && jpegByte(jpg, pos) == 0xFF) {
+        unsigned int marker = jpegByte(jpg, pos + 1);
+        if(marker == 0xDA || marker == 0xD9) return;
+        size_t len = jpegByte(jpg, pos + 2) << 8 | jpegByte(jpg, pos + 3);
+        if(pos + 2 + len > jpg.size()) return;
+        if(marker >= 0xC0 && marker <= 0xC2 && len >= 7) {
+            height = jpegByte(jpg, pos + 5) << 8 | jpegByte(jpg, pos + 6);
+            width = jpegByte(jpg, pos + 7) << 8 | jpegByte(jpg, pos + 8);
+        }
+        if(marker == 0xE1 && len >= 16 && jpg.compare(pos + 4, 6, std::string("Exif\0\0", 6)) == 0) {
+            size_t tiff = pos + 10;
+            size_t tiff_len = len - 8;
+            bool little = jpg[tiff] == 'I';
+            auto read = [&](size_t off, int bytes) -> size_t {
+                if(off + bytes > tiff_len) return 0;
+                size_t value = 0;
+                for(int i = 0; i < bytes; i++)
+                    value |= (size_t) jpegByte(jpg, tiff + off + (little ? i : bytes - 1 - i)) << (8 * i);
+                return value;
+            };
+            //IFD1 (after IFD0) holds the thumbnail's offset and length
+            size_t ifd0 = read(4, 4);
+            size_t ifd1 = ifd0 ? read(ifd0 + 2 + read(ifd0, 2) * 12, 4) : 0;
+            size_t offset = 0;
+            size_t length = 0;
+            for(size_t entry = 0; ifd1 && entry < read(ifd1, 2); entry++) {
+                size_t at = ifd1 + 2 + entry * 12;
+                if(read(at, 2) == 0x0201) offset = read(at + 8, 4);
+                if(read(at, 2) == 0x0202) length = read(at + 8, 4);
+            }
+            if(offset && length && offset + length <= tiff_len)
+                exif_thumb = jpg.substr(tiff + offset, length);
+        }
+        pos += 2 + len;
+    }
+}
+
+static cv::Mat decodePreview(const std::string& jpg, int scale) {
+    std::vector<uchar> buff(jpg.begin(), jpg.end());
+    cv::Mat thumb;
+#ifdef MJPGCLIENT_REDUCED_DECODE
+    //libjpeg scales in the DCT so a 1/8 decode only touches the DC coefficients
+    int reduced = scale >= 8 ? 8 : scale >= 4 ? 4 : scale >= 2 ? 2 : 1;
+    int flag = reduced == 8 ? cv::IMREAD_REDUCED_COLOR_8 : reduced == 4 ? cv::IMREAD_REDUCED_COLOR_4 :
+               reduced == 2 ? cv::IMREAD_REDUCED_COLOR_2 : cv::IMREAD_COLOR;
+    thumb = cv::imdecode(buff, flag);
+    if(!thumb.empty()) {
+        if(scale > reduced)
+            cv::resize(thumb, thumb, cv::Size(), (double) reduced / scale, (double) reduced / scale, cv::INTER_AREA);
+        return thumb;
+    }
+#endif
+    int width = 0;
+    int height = 0;
+    std::string exif_thumb;
+    jpegHeader(jpg, width, height, exif_thumb);
+    if(!exif_thumb.empty()) {
+        std::vector<uchar> exif_buff(exif_thumb.begin(), exif_thumb.end());
+        thumb = cv::imdecode(exif_buff, cv::IMREAD_COLOR);
+        if(!thumb.empty()) {
+            if(width / scale > 0 && height / scale > 0 && (thumb.cols > width / scale || thumb.rows > height / scale))
+                cv::resize(thumb, thumb, cv::Size(width / scale, height / scale), 0, 0, cv::INTER_AREA);
+            return thumb;
+        }
+    }
+
+    //No reduced decode and no EXIF thumbnail, fall back to a full decode
+    thumb = cv::imdecode(buff, cv::IMREAD_COLOR);
+    if(!thumb.empty())
+        cv::resize(thumb, thumb, cv::Size(), 1.0 / scale, 1.0 / scale, cv::INTER_AREA);
+    return thumb;
+}
+
+//!Max buffered bytes without a complete jpeg before the preview stream starts over
+static const size_t MAX_PENDING = 8 * 1024 * 1024;
+//!Max millis without any data before the preview stream reconnects (generous so slow streams don't drop)
+static const int IDLE_TIMEOUT = 30000;
+
+//!Raw connection to the stream that only keeps the newest jpeg, never decodes
+class MjpgClient::PreviewStream {
+    boost::asio::io_service io_service;
+    tcp::resolver resolver;
+    tcp::socket socket;
+    boost::asio::deadline_timer watchdog;
+    boost::asio::deadline_timer retry_timer;
+    std::string host;
+    std::string port;
+    std::string path;
+    int timeout;
+    MjpgClient* client;
+    std::string request;
+    std::string pending;
+    char chunk[16384];
+    boost::thread runner;
+
+    public:
+        PreviewStream(const std::string& host, const std::string& port, const std::string& path, int timeout, MjpgClient* client)
+            : resolver(io_service), socket(io_service), watchdog(io_service), retry_timer(io_service),
+              host(host), port(port), path(path), timeout(timeout), client(client) {}
+
+        void start() {
+            this->watchdog.expires_at(boost::posix_time::pos_infin);
+            this->checkDeadline();
+            this->connect();
+            this->runner = boost::thread([this]() {
+                this->io_service.run();
+            });
+        }
+
+        void stop() {
+            this->io_service.stop();
+            if(this->runner.joinable()) this->runner.join();
+        }
+
+    private:
+        void checkDeadline() {
+            //Closing the socket cancels whatever is pending on it and that handler retries
+            if(this->watchdog.expires_at() <= boost::asio::deadline_timer::traits_type::now()) {
+                boost::system::error_code ignored;
+                this->resolver.cancel();
+                this->socket.close(ignored);
+                this->watchdog.expires_at(boost::posix_time::pos_infin);
+            }
+            this->watchdog.async_wait([this](const boost::system::error_code&) {
+                this->checkDeadline();
+            });
+        }
+
+        void connect() {
+            this->pending.clear();
+            this->watchdog.expires_from_now(boost::posix_time::milliseconds(this->timeout));
+            this->resolver.async_resolve(tcp::resolver::query(this->host, this->port),
+                [this](const boost::system::error_code& err, tcp::resolver::iterator endpoints) {
+                    if(err) return this->retry();
+                    boost::asio::async_connect(this->socket, endpoints,
+                        [this](const boost::system::error_code& err, tcp::resolver::iterator) {
+                            if(err) return this->retry();
+                            std::stringstream st;
+                            st << "GET " << this->path << " HTTP/1.1\r\n";
+                            st << "Host: " << this->host << "\r\n";
+                            st << "Accept: */*\r\n\r\n";
+                            this->request = st.str();
+                            boost::asio::async_write(this->socket, boost::asio::buffer(this->request),
+                                [this](const boost::system::error_code& err, size_t) {
+                                    if(err) return this->retry();
+                                    this->read();
+                                });
+                        });
+                });
+        }
+
+        void read() {
+            this->watchdog.expires_from_now(boost::posix_time::milliseconds(IDLE_TIMEOUT));
+            this->socket.async_read_some(boost::asio::buffer(this->chunk),
+                [this](const boost::system::error_code& err, size_t length) {
+                    if(err) return this->retry();
+                    this->pending.append(this->chunk, length);
+                    this->extract();
+                    this->read();
+                });
+        }
+
+        void extract() {
+            //Multipart headers are skipped, jpegs are found by their own markers
+            std::string newest;
+            size_t soi;
+            while((soi = this->pending.find("\xFF\xD8")) != std::string::npos) {
+                size_t end = jpegEnd(this->pending, soi);
+                if(end == 0) {
+                    this->pending.erase(0, soi + 2);
+                    continue;
+                }
+                if(end == std::string::npos) {
+                    this->pending.erase(0, soi);
+                    if(this->pending.size() > MAX_PENDING) this->pending.clear();
+                    break;
+                }
+                newest = this->pending.substr(soi, end - soi);
+                this->pending.erase(0, end);
+            }
+            if(soi == std::string::npos && !this->pending.empty())
+                this->pending.erase(0, this->pending.size() - 1);
+            if(!newest.empty()) this->client->publishJpeg(newest);
+        }
+
+        void retry() {
+            boost::system::error_code ignored;
+            this->socket.close(ignored);
+            this->watchdog.expires_at(boost::posix_time::pos_infin);
+
+            //Tiles switch to the no connection image until the stream is back
+            std::string dropped;
+            this->client->publishJpeg(dropped);
+            this->retry_timer.expires_from_now(boost::posix_time::milliseconds(500));
+            this->retry_timer.async_wait([this](const boost::system::error_code& err) {
+                if(!err) this->connect();
+            });
+        }
+};
+
+void MjpgClient::publishJpeg(std::string& bytes) {
+    boost::shared_ptr<const Jpeg> last = boost::atomic_load(&this->raw_jpeg);
+    if(bytes.empty() && last && last->bytes.empty()) return;
+    boost::shared_ptr<Jpeg> jpeg = boost::make_shared<Jpeg>();
+    jpeg->bytes.swap(bytes);
+    jpeg->seq = ++this->jpeg_seq;
+    boost::shared_ptr<const Jpeg> published = jpeg;
+    boost::atomic_store(&this->raw_jpeg, published);
+}
+
+void MjpgClient::startPreview() {
+    if(this->previewing) return;
+    boost::lock_guard<boost::mutex> guard(this->preview_stream_lock);
+    if(this->previewing) return;
+    std::string host(this->ip);
+    this->replace(host, "http://", "");
+    this->preview_stream = boost::make_shared<PreviewStream>(host, std::to_string(this->port), "/" + this->name,
+                                                             this->connect_timeout.load(), this);
+    this->preview_stream->start();
+    this->previewing = true;
+}
+
+void MjpgClient::stopPreview() {
+    boost::lock_guard<boost::mutex> guard(this->preview_stream_lock);
+    if(this->preview_stream) this->preview_stream->stop();
+    this->preview_stream.reset();
+    this->previewing = false;
+}
+
+unsigned long MjpgClient::getPreviewSeq() {
+    boost::shared_ptr<const Jpeg> jpeg = boost::atomic_load(&this->raw_jpeg);
+    return jpeg ? jpeg->seq : 0;
+}
+
+boost::shared_ptr<const MjpgClient::Preview> MjpgClient::getPreviewSnapshot() {
+    this->startPreview();
+    boost::shared_ptr<const Jpeg> jpeg;
+    auto newest = [&]() {
+        jpeg = boost::atomic_load(&this->raw_jpeg);
+        if(!jpeg) {
+            Jpeg none = {std::string(), 0};
+            jpeg = boost::make_shared<const Jpeg>(none);
+        }
+    };
+    newest();
+    int scale = std::max(1, this->preview_scale.load());
+    int quality = this->preview_quality.load();
+
+    auto fresh = [&](const boost::shared_ptr<const Preview>& cached) {
+        return cached && cached->source->seq == jpeg->seq && cached->scale == scale && cached->quality == quality;
+    };
+    boost::shared_ptr<const Preview> cached = boost::atomic_load(&this->preview);
+    if(fresh(cached)) return cached;
+
+    //Only one reader builds the preview, the others keep showing the last one meanwhile
+    boost::unique_lock<boost::mutex> guard(this->preview_lock, boost::try_to_lock);
+    if(!guard.owns_lock()) {
+        if(cached) return cached;
+        guard.lock(); //Nothing to show yet, wait for the first build
+    }
+
+    //The builder before us may have moved on to a newer jpeg, never publish an older one over it
+    newest();
+    cached = boost::atomic_load(&this->preview);
+    if(fresh(cached)) return cached;
+
+    boost::shared_ptr<Preview> built = boost::make_shared<Preview>();
+    built->source = jpeg;
+    built->scale = scale;
+    built->quality = quality;
+    try {
+        if(!jpeg->bytes.empty())
+            built->thumb = decodePreview(jpeg->bytes, scale);
+        if(built->thumb.empty()) {
+            //Not connected (or a bad jpeg), show the no connection image
+            cv::Mat no_connection = *boost::atomic_load(&this->no_connection);
+            if(!no_connection.empty())
+                cv::resize(no_connection, built->thumb, cv::Size(), 1.0 / scale, 1.0 / scale, cv::INTER_AREA);
+        }
+        if(!built->thumb.empty()) {
+            std::vector<int> params = {cv::IMWRITE_JPEG_QUALITY, quality};
+            std::vector<uchar> buff;
+            cv::imencode(".jpg", built->thumb, buff, params);
+            built->jpg.assign(buff.begin(), buff.end());
+        }
+    } catch(std::exception& err) {
+        std::cerr << "Preview build error: " << err.what() << std::endl;
+    }
+    cached = built;
+    boost::atomic_store(&this->preview, cached);
+    return cached;
+}
+
+cv::Mat MjpgClient::getPreviewMat(unsigned long& seq) {
+    boost::shared_ptr<const Preview> cached = this->getPreviewSnapshot();
+    seq = cached->source->seq;
+    return cached->thumb;
+}
+
+cv::Mat MjpgClient::getPreviewMat() {
+    return this->getPreviewSnapshot()->thumb;
+}
+
+std::string MjpgClient::getPreview(unsigned long& seq) {
+    boost::shared_ptr<const Preview> cached = this->getPreviewSnapshot();
+    seq = cached->source->seq;
+    return cached->jpg;
+}
+
+std::string MjpgClient::getPreview() {
+    return this->getPreviewSnapshot()->jpg;
+}
+
+void MjpgClient::setPreviewScale(int scale) {
+    this->preview_scale = scale;
+}
+
+void MjpgClient::setPreviewQuality(int quality) {
+    this->preview_quality = quality;
+}
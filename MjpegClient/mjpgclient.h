@@ -34,14 +34,50 @@
 #include <istream>
 #include <ostream>
 #include <string>
+#include <map>
+#include <cstring>
 #include <boost/asio.hpp>
 #include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 #include <boost/chrono.hpp>
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
 #include <ctype.h>
 
 using namespace boost::asio;
 using boost::asio::ip::tcp;
 
+//!Threading model
+/*!
+All public methods except init can be called from any thread.
+
+getFrameMat/getFrame: only one thread pulls from the stream at a time,
+any other thread calling in meanwhile gets the last published frame
+right away. The snapshot is an atomically swapped shared_ptr, that
+goes through boost's spinlock pool so it isn't lock free, but it only
+holds a spinlock for the pointer copy and never waits on the stream. Every
+published frame has a sequence number, threads that loop on frames
+should use getNextFrameMat which sleeps until there is a new one
+instead of spinning on the same frame. Returned mats are shared
+between readers so clone them before drawing on them.
+
+getPreviewMat/getPreview never touch the decoded frames. The first call
+opens a second, raw connection to the stream that only keeps the newest
+jpeg bytes. The thumbnail is decoded from those at reduced size once per
+frame and every other reader of that frame shares it, so dashboards
+that only show previews never decode a full frame. Full frames only
+move while some thread calls getFrameMat/getNextFrameMat.
+
+REST calls each use their own socket so they never block each other or
+the frame readers. Capture control calls never wait on the stream:
+setFPS/setResolution are queued and applied by the pulling thread
+before its next read, getResolution returns the size of the last
+frame that was read.
+
+init must not be called while other threads are using the client.
+*/
 class MjpgClient {
     int max_retry = 20;
     int bad_count = 0;
@@ -51,18 +87,55 @@ class MjpgClient {
     int port = 8080;
     int disc_width = -1;
     int disc_height = -1;
-    int real_fps = 0;
+    boost::atomic<int> real_fps{0};
     cv::Mat last_frame;
-    cv::Mat cur_frame;
-    cv::Mat no_connection;
+    struct Frame {
+        cv::Mat mat;
+        unsigned long seq;
+    };
+    boost::shared_ptr<const Frame> snapshot;
+    unsigned long frame_seq = 0;
+    unsigned long pull_count = 0;
+    boost::mutex frame_lock;
+    boost::condition_variable frame_cond;
+    struct Jpeg {
+        std::string bytes;
+        unsigned long seq;
+    };
+    boost::shared_ptr<const Jpeg> raw_jpeg;
+    unsigned long jpeg_seq = 0;
+    class PreviewStream;
+    boost::shared_ptr<PreviewStream> preview_stream;
+    boost::mutex preview_stream_lock;
+    boost::atomic<bool> previewing{false};
+    struct Preview {
+        boost::shared_ptr<const Jpeg> source;
+        int scale;
+        int quality;
+        cv::Mat thumb;
+        std::string jpg;
+    };
+    boost::shared_ptr<const Preview> preview;
+    boost::mutex preview_lock;
+    boost::atomic<int> preview_scale{8};
+    boost::atomic<int> preview_quality{30};
+    boost::shared_ptr<const cv::Mat> no_connection;
     int frames = 0;
     boost::chrono::high_resolution_clock::time_point start;
+    boost::atomic<int> connect_timeout{2000};
+    boost::mutex pull_lock;
+    boost::mutex ctrl_lock;
+    std::map<int, double> cap_props;
+    boost::atomic<int> cap_width{0};
+    boost::atomic<int> cap_height{0};
 
 
     public:
         //! MjpgClient constructor
         /*!
-        This will start the mjpgserver on the specified port
+        This will start connecting to the stream on the specified port.
+        The connection is opened in the background so constructing many
+        clients doesn't block, use { @code waitReady } to wait for it
 
         @param ip a const char of the ip ex: "http://localhost"
         @param port an integer of the stream port used ex: 8081
@@ -81,7 +154,8 @@ class MjpgClient {
         //!Default init method
         /*!
         Unlike the constructor this is the core that connects to the
-        stream and is used in mainloop when trying to reconnect
+        stream and is used in mainloop when trying to reconnect.
+        Returns right away, the stream is opened on a background thread
 
         @param ip a const char of the ip ex: "http://localhost"
         @param port an integer of the stream port used ex: 8081
@@ -90,16 +164,55 @@ class MjpgClient {
         */
         void init(const char*, int, const char*, char*);
 
+        //!Wait for the stream to be connected
+        /*!
+        Blocks until the background connect has opened the stream
+        or the timeout has passed
+
+        @param timeout max time to wait in millis
+        @return a bool if the stream is connected or not
+        */
+        bool waitReady(int);
+
+        //!Set the connect timeout
+        /*!
+        Max time in millis to wait on opening the stream before
+        giving up (Used on the next connect). How it is applied depends
+        on the OpenCv version:
+        4.5.2 and up: bounds the whole open
+        3.4 up to 4.5.1: goes through OPENCV_FFMPEG_CAPTURE_OPTIONS so the
+        first client to connect sets it for the whole process
+        older (3.1): only bounds reaching the server (tcp connect), a server
+        that accepts but never answers still waits for ffmpeg's own timeout
+
+        @param timeout connect timeout in millis
+        */
+        void setConnectTimeout(int);
+
         //!Gets the current frame
         /*!
         This is the main code for pulling which will check for any
         errors in the buffered images, and display a noconnection image
-        if there is one
+        if there is one. If another thread is already pulling this returns
+        the last frame without waiting
 
         @return A OpenCv Mat with the frame image (if failed it will be the no connection image)
         */
         cv::Mat getFrameMat(void);
 
+        //!Gets the next frame
+        /*!
+        Returns the latest frame if it is newer than seq. Otherwise pulls a new
+        one, or if another thread is already pulling sleeps until it is published
+
+        @param seq sequence number of the last frame seen (0 at first), updated to the returned frame's
+        @return A OpenCv Mat with the frame image (if failed it will be the no connection image)
+        */
+        cv::Mat getNextFrameMat(unsigned long&);
+
+        //!Get the sequence number of the latest published frame
+        unsigned long getFrameSeq(void);
+
         //!Gets the current frame byte string
         /*!
         This calls the above method to process the Mat into a byte string.
@@ -110,6 +223,51 @@ class MjpgClient {
         */
         std::string getFrame(void);
 
+        //!Gets the current preview thumbnail
+        /*!
+        Low resolution copy of the newest frame for dashboards. The first call
+        starts the raw preview connection (no full decodes), the thumbnail is
+        decoded at reduced size (libjpeg DCT scaling, or the EXIF thumbnail)
+        only once per frame and shared by every caller. While another thread
+        is building the new one this returns the previous thumbnail right
+        away. Compare seq with { @code getPreviewSeq } to skip tiles that
+        haven't changed
+
+        @param seq set to the sequence number of the frame the thumbnail is from
+        @return A OpenCv Mat of the thumbnail (shared, clone before drawing on it)
+        */
+        cv::Mat getPreviewMat(unsigned long&);
+        cv::Mat getPreviewMat(void);
+
+        //!Gets the current preview thumbnail byte string
+        /*!
+        Same as { @code getPreviewMat } but jpeg encoded at the preview quality.
+        The encode is also only done once per frame
+
+        @param seq set to the sequence number of the frame the thumbnail is from
+        @return A byte string of the latest thumbnail
+        */
+        std::string getPreview(unsigned long&);
+        std::string getPreview(void);
+
+        //!Get the sequence number of the newest jpeg on the preview connection
+        unsigned long getPreviewSeq(void);
+
+        //!Close the raw preview connection (the next preview call opens it again)
+        void stopPreview(void);
+
+        //!Set the preview downscale
+        /*!
+        @param scale divide the frame width and height by this (default 8)
+        */
+        void setPreviewScale(int);
+
+        //!Set the preview jpeg quality
+        /*!
+        @param quality an integer between 0 - 100 (default 30)
+        */
+        void setPreviewQuality(int);
+
         //!REST GET call to get fps from Titan MjpgServer
         /*!
         Note: Server must be Titan MjpgServer
@@ -153,10 +311,16 @@ class MjpgClient {
         //!Get current pull rate of camera (Not REST)
         int getFPS(void);
 
-        //!Not implemented... (Depending on cv version)
+        //!Not implemented... (Depending on cv version) queued until the next pull
+        /*!
+        Only the last queued value is kept. If the capture rejects it that
+        is only reported on stderr when the pull applies it
+
+        @return a bool if queued or not
+        */
         bool setFPS(int);
 
-        //!Internal method to retrieve frame size (width, heigh)
+        //!Internal method to retrieve frame size (width, heigh) of the last pulled frame
         int* getResolution();
 
         //!REST POST call to set the resolution of the Titan MjpgServer
@@ -186,10 +350,13 @@ class MjpgClient {
         //!Internal method to change frame size
         /*!
         Sets the capture method size (May work or may not working)
+        The change is queued and applied before the next pull, only the last
+        queued size is kept. If the capture rejects it that is only reported
+        on stderr when the pull applies it
 
         @param width new width in pixels
         @param height new height in pixels
-        @return a bool if completed or not
+        @return a bool if queued or not
         */
         bool setResolution(int, int);
 
@@ -237,11 +404,42 @@ class MjpgClient {
 
 
     private:
-        //!Global OpenCv capture method
-        cv::VideoCapture mjpgcap;
+        //!Capture and connect state, shared with the background connect thread so it can outlive the client
+        struct Line {
+            cv::VideoCapture mjpgcap;
+            boost::mutex cap_lock;
+            boost::mutex conn_lock;
+            boost::condition_variable conn_cond;
+            bool connected = false;
+            bool connecting = false;
+        };
+
+        //!Global OpenCv capture line
+        boost::shared_ptr<Line> line;
+
+        //!Private method to open the stream within the timeout (millis)
+        static int getLine(const std::string&, int, cv::VideoCapture&);
+
+        //!Private method to pull a frame from the stream and publish it (unlocks the held pull_lock)
+        boost::shared_ptr<const Frame> pullFrame(boost::unique_lock<boost::mutex>&);
+
+        //!Private method to apply the queued capture changes (pull_lock must be held)
+        void applyCapProps(Line&);
+
+        //!Private method to start the background connect to the stream
+        void connect(void);
+
+        //!Private method to get the cached preview of the newest jpeg (builds it if it's stale)
+        boost::shared_ptr<const Preview> getPreviewSnapshot(void);
+
+        //!Private method to open the raw preview connection if it isn't running
+        void startPreview(void);
+
+        //!Private method for the preview connection to publish the newest jpeg (empty when the stream dropped)
+        void publishJpeg(std::string&);
 
-        //!Private method to test connect stream
-        int getLine(char*);
+        //!Private method to get the shared decoded no connection image
+        static const cv::Mat& defaultNoConnection(void);
 
         //!Private method to make a GET request to the Titan MjpgServer
         void getReq(const char[], std::string *);
@@ -0,0 +1,275 @@
+/**
+    CS-11 Format
+    File: stress.cpp
+    Purpose: Hammer one MjpgClient from many threads against a local stream (build with -fsanitize=thread)
+
+    @author David Smerkous
+    @version 1.0 8/11/2016
+
+    License: MIT License (MIT)
+    Copyright (c) 2016 David Smerkous
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+    INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include "mjpgclient.h" //Include client lib header (OpenCv included)
+
+using boost::asio::ip::tcp;
+
+boost::atomic<int> failures(0); //Broken invariants (exit code)
+boost::mutex report_lock; //Keeps failure lines whole
+
+static void check(bool ok, const std::string& what) {
+    if(ok) return;
+    failures++;
+    boost::lock_guard<boost::mutex> guard(report_lock);
+    std::cerr << "FAILED: " << what << std::endl;
+}
+
+//!Local stand in for a Titan MjpegServer, multipart mjpg stream plus the REST values
+class StressServer {
+    boost::asio::io_service io_service;
+    tcp::acceptor acceptor;
+    int port;
+    boost::atomic<bool> running{true};
+    boost::thread_group handlers;
+    boost::thread listener;
+    boost::mutex state_lock;
+    int fps = 30;
+    int quality = 50;
+    int width = 640;
+    int height = 480;
+    int connections = 10;
+
+    public:
+        StressServer(int port) : acceptor(io_service, tcp::endpoint(boost::asio::ip::address_v4::loopback(), port)), port(port) {
+            this->listener = boost::thread([this]() {
+                while(this->running) {
+                    boost::shared_ptr<tcp::socket> socket = boost::make_shared<tcp::socket>(this->io_service);
+                    boost::system::error_code error;
+                    this->acceptor.accept(*socket, error);
+                    if(error || !this->running) break;
+                    this->handlers.create_thread([this, socket]() {
+                        this->handle(*socket);
+                        boost::system::error_code ignored;
+                        socket->close(ignored); //The REST client reads until the server hangs up
+                    });
+                }
+            });
+        }
+
+        ~StressServer() {
+            //Wake the blocking accept with one last connection
+            this->running = false;
+            try {
+                boost::asio::io_service waker_service;
+                tcp::socket waker(waker_service);
+                waker.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), this->port));
+            } catch(std::exception& err) {}
+            this->listener.join();
+            this->handlers.join_all();
+        }
+
+    private:
+        void handle(tcp::socket& socket) {
+            try {
+                boost::asio::streambuf request;
+                boost::asio::read_until(socket, request, "\r\n\r\n");
+                std::istream request_stream(&request);
+                std::string method;
+                std::string path;
+                request_stream >> method >> path;
+                if(!path.empty() && path[0] == '/') path = path.substr(1);
+
+                if(path == "mjpg") return this->stream(socket);
+
+                std::string header;
+                size_t length = 0;
+                std::getline(request_stream, header);
+                while(std::getline(request_stream, header) && header != "\r") {
+                    if(header.find("Content-Length:") == 0) length = atoi(header.substr(15).c_str());
+                }
+                std::string body;
+                if(method == "POST") {
+                    if(request.size() < length) boost::asio::read(socket, request, boost::asio::transfer_at_least(length - request.size()));
+                    body.resize(length);
+                    request_stream.read(&body[0], length);
+                }
+                this->rest(method, path, body, socket);
+            } catch(std::exception& err) {} //Client hung up (or a connect probe)
+        }
+
+        void rest(const std::string& method, const std::string& path, const std::string& body, tcp::socket& socket) {
+            std::stringstream value;
+            bool found = true;
+            {
+                boost::lock_guard<boost::mutex> guard(this->state_lock);
+                bool post = method == "POST";
+                if(path == "fps") {
+                    if(post) this->fps = atoi(body.c_str());
+                    value << this->fps;
+                } else if(path == "quality") {
+                    if(post) this->quality = atoi(body.c_str());
+                    value << this->quality;
+                } else if(path == "connections") {
+                    if(post) this->connections = atoi(body.c_str());
+                    value << this->connections;
+                } else if(path == "resolution") {
+                    if(post) {
+                        this->width = atoi(body.substr(0, body.find("x")).c_str());
+                        this->height = atoi(body.substr(body.find("x") + 1).c_str());
+                    }
+                    value << this->width << "x" << this->height;
+                } else {
+                    found = false;
+                }
+            }
+            std::stringstream response;
+            response << "HTTP/1.1 " << (found ? "200 OK" : "404 Not Found") << "\r\n";
+            response << "Content-Length: " << value.str().length() << "\r\n";
+            response << "Connection: close\r\n\r\n";
+            response << value.str();
+            boost::asio::write(socket, boost::asio::buffer(response.str()));
+        }
+
+        void stream(tcp::socket& socket) {
+            std::string header = "HTTP/1.0 200 OK\r\nContent-Type: multipart/x-mixed-replace;boundary=stressframe\r\n\r\n";
+            boost::asio::write(socket, boost::asio::buffer(header));
+            for(int count = 0; this->running; count++) {
+                int fps, quality, width, height;
+                {
+                    boost::lock_guard<boost::mutex> guard(this->state_lock);
+                    fps = this->fps;
+                    quality = this->quality;
+                    width = this->width;
+                    height = this->height;
+                }
+
+                //Every frame looks different so a stuck stream shows up as a repeated seq
+                cv::Mat frame(height, width, CV_8UC3, cv::Scalar(count % 256, count * 3 % 256, count * 7 % 256));
+                std::vector<uchar> buff;
+                std::vector<int> params = {cv::IMWRITE_JPEG_QUALITY, std::max(1, std::min(100, quality))};
+                cv::imencode(".jpg", frame, buff, params);
+                std::stringstream part;
+                part << "--stressframe\r\nContent-Type: image/jpeg\r\nContent-Length: " << buff.size() << "\r\n\r\n";
+                part.write((const char*) buff.data(), buff.size());
+                part << "\r\n";
+                boost::asio::write(socket, boost::asio::buffer(part.str()));
+                boost::this_thread::sleep_for(boost::chrono::milliseconds(1000 / std::max(1, std::min(100, fps))));
+            }
+        }
+};
+
+int main(int argc, char *argv[]) {
+    //usage: stress [seconds] [readers] [port], serves its own stream on 127.0.0.1:port
+
+    const char ip[] = "http://127.0.0.1"; //Ip base of the local stream
+    int seconds = argc > 1 ? atoi(argv[1]) : 10; //How long to run
+    int readers = argc > 2 ? atoi(argv[2]) : 8; //Amount of frame reader threads
+    int port = argc > 3 ? atoi(argv[3]) : 8091; //Port of the local stream
+    const char name[] = "mjpg"; //extension
+    const int max_width = 640; //Largest resolution the control thread asks for
+
+    StressServer server(port);
+
+    //A generated no connection image so frames are never empty, even without noconnection.jpg around
+    const char disc_path[] = "stress_noconnection.jpg";
+    cv::imwrite(disc_path, cv::Mat(max_width / 2, max_width / 2, CV_8UC3, cv::Scalar(0, 0, 255)));
+
+    boost::atomic<long> pulls(0);
+    boost::atomic<long> previews(0);
+    {
+        MjpgClient client(ip, port, name); //Get cap line
+        char addr[64];
+        client.init(ip, port, name, addr); //Only safe before other threads use the client
+        client.setDiscPath(disc_path);
+        client.setConnectTimeout(2000);
+        check(client.waitReady(5000), "waitReady on a local stream");
+
+        boost::atomic<bool> running(true);
+        boost::thread_group threads;
+
+        for(int i = 0; i < readers; i++) {
+            threads.create_thread([&client, &running, &pulls, &previews, i, max_width]() {
+                unsigned long seq = 0;
+                unsigned long last_seq = 0;
+                unsigned long preview_seq = 0;
+                while(running) {
+                    if(i % 3 == 0) {
+                        check(!client.getFrameMat().empty(), "getFrameMat returned an empty frame"); //Puller or snapshot reader
+                        check(!client.getFrame().empty(), "getFrame returned no bytes");
+                    } else if(i % 3 == 1) {
+                        unsigned long before = seq;
+                        cv::Mat frame = client.getNextFrameMat(seq); //Sleeps until a new frame
+                        check(seq > before, "getNextFrameMat didn't move seq forward");
+                        check(!frame.empty(), "getNextFrameMat returned an empty frame");
+                    } else {
+                        unsigned long before = preview_seq;
+                        cv::Mat thumb = client.getPreviewMat(preview_seq);
+                        std::string jpg = client.getPreview(preview_seq); //Shared thumbnail, never a full decode
+                        check(preview_seq >= before, "preview seq went backwards");
+                        check(preview_seq <= client.getPreviewSeq(), "preview is newer than the preview stream");
+                        check(!thumb.empty() && thumb.cols <= max_width / 4, "preview isn't reduced");
+                        check(!jpg.empty() && !client.getPreview().empty(), "getPreview returned no bytes");
+                        check(!client.getPreviewMat().empty(), "getPreviewMat returned an empty thumbnail");
+                        if(preview_seq == client.getPreviewSeq()) client.sleep(1); //Tile is up to date
+                        previews++;
+                    }
+                    unsigned long frame_seq = client.getFrameSeq();
+                    check(frame_seq >= last_seq, "getFrameSeq went backwards");
+                    last_seq = frame_seq;
+                    client.getFPS();
+                    client.getResolution();
+                    pulls++;
+                }
+            });
+        }
+
+        threads.create_thread([&client, &running, &disc_path, max_width]() { //Control thread
+            int step = 0;
+            while(running) {
+                client.setDiscDim(max_width / 2 + step % 2 * max_width / 2, max_width * 3 / 8 + step % 2 * max_width * 3 / 8); //Swap the no connection image
+                client.setFPS(30);
+                client.setResolution(max_width, max_width * 3 / 4);
+                client.setConnectTimeout(1000 + step % 2 * 1000);
+                client.waitReady(10);
+                client.setPreviewScale(4 + step % 2 * 4);
+                client.setPreviewQuality(20 + step % 2 * 10);
+                if(step % 10 == 0) {
+                    //Every REST value reads back what was just set (only this thread sets them)
+                    int value = 20 + step / 10 % 10;
+                    check(client.setServerFPS(value) && client.getServerFPS() == value, "server fps round trip");
+                    check(client.setServerQuality(value) && client.getServerQuality() == value, "server quality round trip");
+                    check(client.setServerConnections(value) && client.getServerConnections() == value, "server connections round trip");
+                    int width = max_width / (1 + step / 10 % 2);
+                    check(client.setServerResolution(width, width * 3 / 4), "setServerResolution");
+                    int* dims = client.getServerResolution();
+                    check(dims[0] == width && dims[1] == width * 3 / 4, "server resolution round trip");
+                }
+                if(step % 50 == 25) client.stopPreview(); //The next preview call reopens it
+                if(step % 50 == 0) client.setDiscPath(disc_path);
+                client.sleep(5);
+                step++;
+            }
+        });
+
+        client.sleep(seconds * 1000);
+        running = false;
+        threads.join_all();
+        check(client.getFrameSeq() > 0, "no frames were published");
+        check(client.getPreviewSeq() > 0, "the preview stream never got a jpeg");
+        std::cout << "Reads: " << pulls << " Previews: " << previews << " FPS: " << client.getFPS() << " Frames: " << client.getFrameSeq() << std::endl;
+    }
+    std::remove(disc_path);
+    std::cout << (failures ? "Stress failed: " : "Stress passed: ") << failures << " broken invariants" << std::endl;
+    return failures ? 1 : 0;
+}